@@ -0,0 +1,100 @@
+// CoolBoy embedding API. Compile CoolBoy.c with -DCOOLBOY_LIBRARY, which leaves out
+// main(), into a static or shared library and include this header. Instances are
+// independent and not thread-safe; use one thread per instance at a time.
+#ifndef COOLBOY_H
+#define COOLBOY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(COOLBOY_LIBRARY)
+#define COOLBOY_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define COOLBOY_API __attribute__((visibility("default")))
+#else
+#define COOLBOY_API
+#endif
+
+// Bumped whenever a declaration below changes incompatibly
+#define COOLBOY_API_VERSION 1
+
+#define COOLBOY_SCREEN_WIDTH 160
+#define COOLBOY_SCREEN_HEIGHT 144
+#define COOLBOY_WRAM_SIZE 0x2000     // 0xC000-0xDFFF
+#define COOLBOY_HRAM_SIZE 0x7F       // 0xFF80-0xFFFE
+
+// Button bits for coolboy_set_input; a set bit means held down
+#define COOLBOY_RIGHT  0x01
+#define COOLBOY_LEFT   0x02
+#define COOLBOY_UP     0x04
+#define COOLBOY_DOWN   0x08
+#define COOLBOY_A      0x10
+#define COOLBOY_B      0x20
+#define COOLBOY_SELECT 0x40
+#define COOLBOY_START  0x80
+
+// Flags for coolboy_create
+#define COOLBOY_NO_APU       0x01    // Skip sound emulation (nothing is played either way)
+#define COOLBOY_NO_IDLE_SKIP 0x02    // Execute busy-wait loops instead of skipping them
+
+typedef struct CoolBoy CoolBoy;
+
+COOLBOY_API int coolboy_api_version(void);
+
+// Create an instance running a copy of the ROM image. Returns NULL if the ROM is too
+// large or memory runs out.
+COOLBOY_API CoolBoy *coolboy_create(const uint8_t *rom, size_t size, unsigned flags);
+COOLBOY_API void coolboy_destroy(CoolBoy *gb);
+
+// Buttons held from now on (COOLBOY_* bits)
+COOLBOY_API void coolboy_set_input(CoolBoy *gb, uint8_t buttons);
+
+// Run whole video frames
+COOLBOY_API void coolboy_step(CoolBoy *gb, int frames);
+
+// Set inputs[i] on gbs[i] (inputs may be NULL to keep them) and run every instance
+// for the same number of frames, in one call
+COOLBOY_API void coolboy_step_batch(CoolBoy *const *gbs, const uint8_t *inputs, size_t count, int frames);
+
+// Zero-copy views that stay valid for the life of the instance. The framebuffer is
+// COOLBOY_SCREEN_WIDTH * COOLBOY_SCREEN_HEIGHT pixels, each stored as R, G, B, A bytes.
+COOLBOY_API const uint32_t *coolboy_framebuffer(const CoolBoy *gb);
+COOLBOY_API uint8_t *coolboy_wram(CoolBoy *gb);
+COOLBOY_API uint8_t *coolboy_hram(CoolBoy *gb);
+
+// Cartridge RAM and its size in bytes; NULL with *size 0 if the cartridge has none
+COOLBOY_API uint8_t *coolboy_cart_ram(CoolBoy *gb, size_t *size);
+
+// Connect the link ports of two instances. Linked instances meet every 1024 cycles,
+// so each must be stepped on its own thread. Returns 0 on failure.
+COOLBOY_API int coolboy_link(CoolBoy *a, CoolBoy *b);
+
+// Connect the link port to whichever instance, in any process on this host, joins
+// the same name (POSIX only). Returns 0 on failure.
+COOLBOY_API int coolboy_link_shared(CoolBoy *gb, const char *name);
+
+// Unplug the link cable; the partner carries on alone
+COOLBOY_API void coolboy_unlink(CoolBoy *gb);
+
+// Apply a Game Genie (ABC-DEF, ABC-DEF-GHI) or GameShark (01VVLLHH) code. ROM
+// patches take effect at once, RAM values are stored at the end of every frame.
+// Returns 0 if the code is malformed or patches no ROM byte.
+COOLBOY_API int coolboy_add_cheat(CoolBoy *gb, const char *code);
+COOLBOY_API void coolboy_clear_cheats(CoolBoy *gb);
+
+// Read any address as the CPU would see it, without side effects
+COOLBOY_API uint8_t coolboy_read(CoolBoy *gb, uint16_t address);
+
+// Emulated clock cycles (4194304 per second) and completed frames
+COOLBOY_API uint64_t coolboy_cycles(const CoolBoy *gb);
+COOLBOY_API uint64_t coolboy_frames(const CoolBoy *gb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif